@@ -0,0 +1,132 @@
+/* $Id$ */
+
+/*
+ * The gamma LookUpTables of toXYZ.
+ *
+ * All the tables are carved out of one arena, aligned on a huge page and backed
+ * by huge pages when the system has them (explicit ones first, then transparent
+ * ones), so the random lookups into lut.out do not also miss in the TLB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <sys/mman.h>
+
+#include "lut.h"
+
+#define	HUGE_PAGE	(2L<<20)
+#define	ALIGN(n, a)	(((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+#define	ARENA_MALLOC	0
+#define	ARENA_THP		1		/* transparent huge pages asked for */
+#define	ARENA_HUGETLB	2		/* explicit huge pages */
+
+/****************************************************************************************************/
+/* arena_alloc gets size bytes (rounded up to a huge page) for the tables.							*/
+/****************************************************************************************************/
+static int arena_alloc(gammalut *l, size_t size)
+{
+	void *p = NULL;
+
+	l->arena_size = ALIGN(size, HUGE_PAGE);
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, l->arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+	{
+		l->arena 		= p;
+		l->arena_kind 	= ARENA_HUGETLB;
+		return (0);
+	}
+#endif
+	if (posix_memalign(&p, HUGE_PAGE, l->arena_size))
+		return (-1);
+	l->arena 		= p;
+	l->arena_kind 	= ARENA_MALLOC;
+#ifdef MADV_HUGEPAGE
+	if (madvise(p, l->arena_size, MADV_HUGEPAGE) == 0)
+		l->arena_kind = ARENA_THP;
+#endif
+	return (0);
+}
+
+/****************************************************************************************************/
+/*  lut_make makes the luts to not have to use the power function on each pixel.					*/
+/* The output table has B_LEN*precision entries, or if ninterp is not 0, ninterp+1 knots to			*/
+/* interpolate between. Returns 0 if ok.															*/
+/****************************************************************************************************/
+int lut_make(gammalut *l, float g_in, float g_out, uint32 precision, uint32 ninterp)
+{
+	size_t	in_size, out_size, knot_size;
+	uint32	i, nout;
+	uint8	*p;
+
+	memset(l, 0, sizeof(*l));
+	if (precision < 1 || precision > MAX_PRECISION)
+	{
+		fprintf(stderr, "Precision must be between 1 and %d\n", MAX_PRECISION);
+		return (-1);
+	}
+	if (ninterp > MAX_INTERP)
+	{
+		fprintf(stderr, "The interpolated LUT must have between 1 and %d entries\n", MAX_INTERP);
+		return (-1);
+	}
+	l->precision 	= precision;
+	l->ninterp 		= ninterp;
+	nout 			= B_LEN * precision;
+
+	/* the table used at random goes first */
+	in_size 	= ALIGN(B_LEN * sizeof(float), 64);
+	out_size 	= ninterp? 0 : ALIGN(nout * sizeof(uint16), 64);
+	knot_size 	= ninterp? ALIGN((ninterp + 1) * sizeof(float), 64) : 0;
+	if (arena_alloc(l, out_size + knot_size + in_size))
+	{
+		fprintf(stderr, "No space for the LUTs\n");
+		return (-1);
+	}
+	p = (uint8 *) l->arena;
+	if (ninterp)
+	{
+		l->knots = (float *) p;
+		l->kscale = (float) ninterp;
+		for (i = 0; i <= ninterp; i++)
+			l->knots[i] = powf(powf((float)i/(float)ninterp, 4.0f), g_out) * (B_LEN - 1);
+	}
+	else
+	{
+		l->out = (uint16 *) p;
+		l->scale = (double)(nout - 1);
+		for (i = 0; i < nout; i++)
+			l->out[i] = (uint16)(powf((float)i/(float)(nout - 1), g_out) * (B_LEN - 1));
+	}
+	l->in = (float *)(p + out_size + knot_size);
+	for (i = 0; i < B_LEN; i++)
+		l->in[i] = powf((float)i/(float)(B_LEN - 1), g_in);
+	return (0);
+}
+
+/****************************************************************************************************/
+void lut_free(gammalut *l)
+{
+	if (l->arena == NULL)
+		return;
+	if (l->arena_kind == ARENA_HUGETLB)
+		munmap(l->arena, l->arena_size);
+	else
+		free(l->arena);
+	l->arena = NULL;
+}
+
+/****************************************************************************************************/
+const char *lut_arena_kind(const gammalut *l)
+{
+	switch (l->arena_kind)
+	{
+	case ARENA_HUGETLB:	return ("explicit huge pages");
+	case ARENA_THP:		return ("transparent huge pages");
+	default:			return ("normal pages");
+	}
+}
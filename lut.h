@@ -0,0 +1,61 @@
+/* $Id$ */
+
+/*
+ * The gamma LookUpTables of toXYZ.
+ *
+ * lut.in takes a 16 bit code to linear light. lut.out takes linear light back
+ * to a 16 bit code, either directly from a table of B_LEN*precision entries, or
+ * by interpolating a much smaller table that stays in the L2 cache.
+ */
+
+#ifndef LUT_H
+#define LUT_H
+
+#include <stddef.h>
+#include <math.h>
+#include <tiffio.h>
+
+#define	B_DEPTH		16		/* # bits/pixel to use */
+#define	B_LEN		(1L<<B_DEPTH)
+#define PRECISION	8		/* how much more in the linear space do we want over 16 bits... */
+#define MAX_PRECISION	256
+#define MAX_INTERP	65536	/* # knots of the interpolated table, beyond this use a direct table */
+
+typedef struct {
+	float	*in;		/* B_LEN entries */
+	uint16	*out;		/* B_LEN*precision entries, NULL when interpolating */
+	float	*knots;		/* ninterp+1 entries, NULL when not interpolating */
+	double	scale;		/* linear value -> index in out */
+	float	kscale;		/* fourth root of linear value -> index in knots */
+	uint32	precision;
+	uint32	ninterp;
+	void	*arena;		/* everything above lives in here */
+	size_t	arena_size;
+	int		arena_kind;
+} gammalut;
+
+extern	int  lut_make(gammalut *, float, float, uint32, uint32);
+extern	void lut_free(gammalut *);
+extern	const char *lut_arena_kind(const gammalut *);
+
+/****************************************************************************************************/
+/* lut_apply takes a linear value back to a 16 bit code. Values over 1.0 are clipped.				*/
+/****************************************************************************************************/
+static inline uint16 lut_apply(const gammalut *l, float v)
+{
+	uint32	k;
+	float	u, f;
+
+	if (l->out != NULL)
+		return (l->out[(uint32)(((v > 1.0)? 1.0 : v) * l->scale)]);
+
+	/* the 1/2.6 curve is steep at black but smooth against the fourth root of the value */
+	u = sqrtf(sqrtf((v > 1.0f)? 1.0f : v)) * l->kscale;
+	k = (uint32) u;
+	if (k >= l->ninterp)
+		k = l->ninterp - 1;
+	f = u - (float) k;
+	return ((uint16)(l->knots[k] + f * (l->knots[k+1] - l->knots[k])));
+}
+
+#endif /* LUT_H */
@@ -0,0 +1,134 @@
+/* $Id$ */
+
+/*
+ * A benchmark of the output LUT sizes of toXYZ.
+ *
+ * For each table size it prints the error against the exact power function
+ * (in 16 bit codes, and in the 12 bit codes of the final X'Y'Z') and the time
+ * of a lookup on values in random order, as they come from a noisy frame.
+ *
+ * lutbench [-g input_gamma] [-n samples]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "lut.h"
+
+#define GAMMA (2.6)
+#define DEGAMMA (1/2.6)
+#define	REPEAT	4
+
+static uint32 precisions[] 	= {1, 2, 4, 8, 16, 64, MAX_PRECISION, 0};
+static uint32 interps[] 	= {256, 1024, 4096, 16384, 65536, 0};
+volatile uint32 sink;		/* keeps the lookups from being optimised away */
+
+static	void bench(float, float, uint32, uint32, float *, uint32);
+static	void usage(void);
+
+/****************************************************************************************************/
+int main(int argc, char* argv[])
+{
+	float	gamma_in = GAMMA, *values;
+	uint32	n = 1<<22, i;
+	int		c;
+	gammalut lut;
+
+	while ((c = getopt(argc, argv, "g:n:")) != -1)
+		switch (c) {
+		case 'g':		/* gamma in */
+			sscanf(optarg, "%f", &gamma_in);
+			break;
+		case 'n':		/* # samples */
+			n = atoi(optarg);
+			break;
+		case '?':
+			usage();
+			/*NOTREACHED*/
+		}
+	if (n == 0)
+		usage();
+
+	/* linear values as they come out of the input LUT for random 16 bit codes */
+	if (lut_make(&lut, gamma_in, DEGAMMA, 1, 0))
+		return (-1);
+	values = (float *) malloc(n * sizeof(float));
+	if (values == NULL)
+		return (-1);
+	srand(2007);
+	for (i = 0; i < n; i++)
+		values[i] = lut.in[rand() & (B_LEN - 1)];
+	lut_free(&lut);
+
+	printf("%-8s %10s %10s %-24s %10s %10s %10s %10s\n", "table", "entries", "bytes", "pages",
+		   "max16", "mean16", "max12", "ns/lookup");
+	for (i = 0; precisions[i]; i++)
+		bench(gamma_in, DEGAMMA, precisions[i], 0, values, n);
+	for (i = 0; interps[i]; i++)
+		bench(gamma_in, DEGAMMA, PRECISION, interps[i], values, n);
+
+	free(values);
+	return (0);
+}
+
+/****************************************************************************************************/
+/* bench prints the accuracy and speed of one output LUT.											*/
+/****************************************************************************************************/
+static void bench(float g_in, float g_out, uint32 precision, uint32 ninterp, float *values, uint32 n)
+{
+	gammalut lut;
+	struct timespec t0, t1;
+	double	err, max = 0, sum = 0, ns, v;
+	uint32	i, k, check = 0;
+	char	name[32];
+
+	if (lut_make(&lut, g_in, g_out, precision, ninterp))
+		return;
+
+	/* accuracy, both uniform in linear light and uniform in code values (dense near black) */
+	for (i = 0; i <= n; i++)
+	{
+		for (k = 0; k < 2; k++)
+		{
+			v = k? pow((double) i / n, GAMMA) : (double) i / n;
+			err = fabs(lut_apply(&lut, (float) v) - pow(v, g_out) * (B_LEN - 1));
+			sum += err;
+			if (err > max)
+				max = err;
+		}
+	}
+
+	/* speed */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (k = 0; k < REPEAT; k++)
+		for (i = 0; i < n; i++)
+			check += lut_apply(&lut, values[i]);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	sink = check;
+	ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / ((double) n * REPEAT);
+
+	if (ninterp)
+		sprintf(name, "interp");
+	else
+		sprintf(name, "x%u", precision);
+	printf("%-8s %10lu %10lu %-24s %10.2f %10.3f %10.2f %10.2f\n", name,
+		   ninterp? (unsigned long) ninterp + 1 : (unsigned long) B_LEN * precision,
+		   ninterp? (unsigned long)(ninterp + 1) * sizeof(float) : (unsigned long) B_LEN * precision * sizeof(uint16),
+		   lut_arena_kind(&lut), max, sum / (2.0 * (n + 1)), max / 16, ns);
+	lut_free(&lut);
+}
+
+/****************************************************************************************************/
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: lutbench [-g input_gamma] [-n samples]\n");
+	exit(-1);
+}
@@ -0,0 +1,259 @@
+/* $Id$ */
+
+/*
+ * Manifest of converted frames for incremental reprocessing.
+ *
+ * The content hash is XXH64 (seed 0) of the whole input file, computed while
+ * streaming the file in large blocks. It costs one sequential read of the file,
+ * which also leaves it in the page cache for the conversion if one is needed.
+ *
+ * The manifest is a directory with one small record per output, named after a
+ * hash of the output's path, so a check only ever reads the records it needs
+ * however long the reel is, and there is nothing to compact.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "manifest.h"
+
+#define	HASH_BLOCK	(1L<<20)		/* # bytes read at a time, must be a multiple of 32 */
+#define	LINE_LEN	4096
+
+#define	P1	11400714785074694791ULL
+#define	P2	14029467366897019727ULL
+#define	P3	 1609587929392839161ULL
+#define	P4	 9650029242287828579ULL
+#define	P5	 2870177450012600261ULL
+
+#define	ROTL(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+/* the reads assume a little endian host, as do the files we hash */
+static uint64_t read64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static uint32_t read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+static uint64_t round64(uint64_t acc, uint64_t in)
+{
+	acc += in * P2;
+	acc  = ROTL(acc, 31);
+	return (acc * P1);
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t v)
+{
+	acc ^= round64(0, v);
+	return (acc * P1 + P4);
+}
+
+/****************************************************************************************************/
+/* hash_file computes the content hash of a file. Returns 0 if ok.									*/
+/****************************************************************************************************/
+int hash_file(const char *name, uint64_t *hash)
+{
+	uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = -P1, h, total = 0;
+	uint8_t	*buf, *p, *end;
+	ssize_t	n = 0;
+	size_t	len;
+	int		fd;
+
+	if ((fd = open(name, O_RDONLY)) < 0)
+	{
+		perror(name);
+		return (-1);
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	buf = (uint8_t *) malloc(HASH_BLOCK);
+	if (buf == NULL)
+	{
+		close(fd);
+		return (-1);
+	}
+
+	for (;;)
+	{
+		/* fill a whole block so only the last one can have a tail */
+		for (len = 0; len < HASH_BLOCK; len += n)
+			if ((n = read(fd, buf + len, HASH_BLOCK - len)) <= 0)
+				break;
+		if (n < 0)
+		{
+			perror(name);
+			free(buf);
+			close(fd);
+			return (-1);
+		}
+		total += len;
+		end = buf + len;
+		for (p = buf; p + 32 <= end; p += 32)
+		{
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+		}
+		if (len < HASH_BLOCK)
+			break;
+	}
+
+	if (total >= 32)
+	{
+		h = ROTL(v1, 1) + ROTL(v2, 7) + ROTL(v3, 12) + ROTL(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	}
+	else
+		h = P5;
+	h += total;
+
+	/* and the tail of the last block */
+	for (; p + 8 <= end; p += 8)
+		h = ROTL(h ^ round64(0, read64(p)), 27) * P1 + P4;
+	if (p + 4 <= end)
+	{
+		h = ROTL(h ^ (read32(p) * P1), 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		h = ROTL(h ^ (*p * P5), 11) * P1;
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+
+	*hash = h;
+	free(buf);
+	close(fd);
+	return (0);
+}
+
+/****************************************************************************************************/
+/* record_name puts in name the file holding the entry for output: the FNV-1a hash of its path, the	*/
+/* first two digits of which are a subdirectory so that no directory gets too big for a reel.		*/
+/* With dir set, only the subdirectory. Returns 0 if ok.											*/
+/****************************************************************************************************/
+static int record_name(char *name, size_t size, const char *manifest, const char *output, int dir)
+{
+	uint64_t h = 14695981039346656037ULL;
+	const char *s;
+	int n;
+
+	for (s = output; *s; s++)
+		h = (h ^ (uint8_t) *s) * 1099511628211ULL;
+	if (dir)
+		n = snprintf(name, size, "%s/%02x", manifest, (unsigned) (h >> 56));
+	else
+		n = snprintf(name, size, "%s/%02x/%014llx", manifest, (unsigned) (h >> 56),
+					 (unsigned long long) (h & 0xffffffffffffffULL));
+	return ((n < 0 || n >= (int) size)? -1 : 0);
+}
+
+/****************************************************************************************************/
+/* manifest_open makes sure the manifest directory exists. Returns 0 if ok.							*/
+/****************************************************************************************************/
+int manifest_open(const char *manifest)
+{
+	struct stat st;
+
+	if (mkdir(manifest, 0777) && errno != EEXIST)
+	{
+		perror(manifest);
+		return (-1);
+	}
+	if (stat(manifest, &st) || !S_ISDIR(st.st_mode))
+	{
+		fprintf(stderr, "%s: manifest must be a directory\n", manifest);
+		return (-1);
+	}
+	return (0);
+}
+
+/****************************************************************************************************/
+/* manifest_check returns 1 if the entry for output in the manifest has the same input hash and		*/
+/* parameters, and the output still exists. Otherwise returns 0.									*/
+/****************************************************************************************************/
+int manifest_check(const char *manifest, const char *output, uint64_t hash, const char *params)
+{
+	FILE	*fp;
+	char	line[LINE_LEN], p[LINE_LEN];
+	unsigned long long h;
+	int		n, found = 0;
+
+	if (record_name(line, sizeof(line), manifest, output, 0) || (fp = fopen(line, "r")) == NULL)
+		return (0);
+	if (fgets(line, sizeof(line), fp) != NULL)
+	{
+		line[strcspn(line, "\n")] = '\0';
+		/* the path is kept in the entry, two outputs may share a record name */
+		if (sscanf(line, "%llx %4095s %n", &h, p, &n) == 2 && !strcmp(line + n, output))
+			found = (h == hash && !strcmp(p, params));
+	}
+	fclose(fp);
+	return (found && access(output, F_OK) == 0);
+}
+
+/****************************************************************************************************/
+/* manifest_add records the entry for output in the manifest, replacing any previous one.			*/
+/* Returns 0 if ok. The entry is written aside and renamed into place, so that concurrent runs		*/
+/* can share one manifest and a reader never sees half an entry.									*/
+/****************************************************************************************************/
+int manifest_add(const char *manifest, const char *output, uint64_t hash, const char *params)
+{
+	char	line[LINE_LEN], name[LINE_LEN], tmp[LINE_LEN + 16];
+	int		fd, n;
+
+	n = snprintf(line, sizeof(line), "%016llx %s %s\n", (unsigned long long) hash, params, output);
+	if (n < 0 || n >= (int) sizeof(line) || record_name(name, sizeof(name), manifest, output, 1))
+		return (-1);
+	if (mkdir(name, 0777) && errno != EEXIST)
+	{
+		perror(name);
+		return (-1);
+	}
+	if (record_name(name, sizeof(name), manifest, output, 0))
+		return (-1);
+	sprintf(tmp, "%s.%ld", name, (long) getpid());
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+	{
+		perror(tmp);
+		return (-1);
+	}
+	if (write(fd, line, n) != n || close(fd) || rename(tmp, name))
+	{
+		perror(tmp);
+		unlink(tmp);
+		return (-1);
+	}
+	return (0);
+}
+
+/****************************************************************************************************/
+/* manifest_invalidate drops the entry for output before it is replaced, so that a run that dies	*/
+/* before its own manifest_add does not leave an older entry in force. Returns 0 if ok.				*/
+/****************************************************************************************************/
+int manifest_invalidate(const char *manifest, const char *output)
+{
+	char	name[LINE_LEN];
+
+	if (record_name(name, sizeof(name), manifest, output, 0))
+		return (-1);
+	if (unlink(name) && errno != ENOENT)
+	{
+		perror(name);
+		return (-1);
+	}
+	return (0);
+}
@@ -0,0 +1,27 @@
+/* $Id$ */
+
+/*
+ * Manifest of converted frames for incremental reprocessing.
+ *
+ * A manifest is a directory holding one record per output. A record is a line
+ * with the content hash of the input, the transform parameters used and the
+ * output that was produced from them:
+ *
+ *     <hash> <parameters> <output>
+ *
+ * A new entry for an output replaces the old one. While an output is being
+ * replaced it has no entry.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+
+extern	int  hash_file(const char *, uint64_t *);
+extern	int  manifest_open(const char *);
+extern	int  manifest_check(const char *, const char *, uint64_t, const char *);
+extern	int  manifest_add(const char *, const char *, uint64_t, const char *);
+extern	int  manifest_invalidate(const char *, const char *);
+
+#endif /* MANIFEST_H */
@@ -0,0 +1,295 @@
+/* $Id$ */
+
+/*
+ * Read-ahead / write-behind pipeline for the CST tiff tools.
+ *
+ * Lines are handed between the stages a chunk at a time, so the locks are only
+ * taken once every few hundred lines. Each TIFF is only ever used from one
+ * thread: the inputs from the reader, each output from its own writer. All the
+ * outputs move forward together, a line of each for every input line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+/****************************************************************************************************/
+/* The rings. A producer waits for a free chunk, fills it and puts it; a consumer waits for a full	*/
+/* chunk, empties it and gives it back. Either side can end it all (done, stop).					*/
+/****************************************************************************************************/
+static int ring_init(ring *q, size_t linesize, uint32 rows)
+{
+	memset(q, 0, sizeof(*q));
+	q->linesize = linesize;
+	q->rows 	= rows;
+	q->buf 		= (uint8 *) _TIFFmalloc((tmsize_t) RING_SLOTS * rows * linesize);
+	if (q->buf == NULL)
+		return (-1);
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	return (0);
+}
+
+static void ring_free(ring *q)
+{
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+	_TIFFfree(q->buf);
+}
+
+static uint8 *ring_line(ring *q, int slot, uint32 line)
+{
+	return (q->buf + ((size_t) slot * q->rows + line) * q->linesize);
+}
+
+/* wait for a free chunk, -1 if the consumer stopped */
+static int ring_wait_free(ring *q)
+{
+	int slot;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->put - q->got == RING_SLOTS && !q->stop)
+		pthread_cond_wait(&q->cond, &q->lock);
+	slot = q->stop? -1 : (int)(q->put % RING_SLOTS);
+	pthread_mutex_unlock(&q->lock);
+	return (slot);
+}
+
+/* hand a chunk of n lines to the consumer */
+static void ring_put(ring *q, int slot, uint32 n)
+{
+	pthread_mutex_lock(&q->lock);
+	q->count[slot] = n;
+	q->put++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* wait for a full chunk, -1 if there are no more */
+static int ring_wait_full(ring *q, uint32 *n)
+{
+	int slot = -1;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->put == q->got && !q->done && !q->stop)
+		pthread_cond_wait(&q->cond, &q->lock);
+	if (q->put != q->got && !q->stop)
+	{
+		slot = (int)(q->got % RING_SLOTS);
+		*n 	 = q->count[slot];
+	}
+	pthread_mutex_unlock(&q->lock);
+	return (slot);
+}
+
+/* give an emptied chunk back to the producer */
+static void ring_give(ring *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->got++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void ring_end(ring *q, int stop)
+{
+	pthread_mutex_lock(&q->lock);
+	if (stop)
+		q->stop = 1;
+	else
+		q->done = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/****************************************************************************************************/
+/* The reader thread fills the input ring, in order, until the end of the image or an error.		*/
+/****************************************************************************************************/
+static void *reader_thread(void *arg)
+{
+	pipeline *p = (pipeline *) arg;
+	uint32	row = 0, n;
+	int		slot;
+
+	while (row < p->nrows && !p->rerr)
+	{
+		if ((slot = ring_wait_free(&p->inq)) < 0)
+			break;
+		for (n = 0; n < p->inq.rows && row < p->nrows; n++, row++)
+			if (p->read(p->ctx, ring_line(&p->inq, slot, n), row) <= 0)
+			{
+				p->rerr = 1;
+				break;
+			}
+		if (n > 0)
+			ring_put(&p->inq, slot, n);
+	}
+	ring_end(&p->inq, 0);
+	return (NULL);
+}
+
+/****************************************************************************************************/
+/* A writer thread drains its output ring, in order, until there is nothing left or an error.		*/
+/****************************************************************************************************/
+static void *writer_thread(void *arg)
+{
+	writer	*w = (writer *) arg;
+	uint32	i, n;
+	int		slot;
+
+	while ((slot = ring_wait_full(&w->q, &n)) >= 0)
+	{
+		for (i = 0; i < n; i++, w->written++)
+			if (TIFFWriteScanline(w->out, ring_line(&w->q, slot, i), w->written, 0) < 0)
+				break;
+		if (i < n)
+		{
+			w->err = 1;
+			ring_end(&w->q, 1);
+			break;
+		}
+		ring_give(&w->q);
+	}
+	return (NULL);
+}
+
+/****************************************************************************************************/
+/* pipeline_open starts reading nrows lines of insize bytes with read(ctx, line, row). Lines of		*/
+/* outsize bytes are written to each of the nout outputs out[]. Returns 0 if ok.					*/
+/****************************************************************************************************/
+int pipeline_open(pipeline *p, linereader read, void *ctx, size_t insize, uint32 nrows, TIFF **out, int nout, size_t outsize)
+{
+	uint32 rows;
+	int k;
+
+	if (nout > MAX_OUTPUTS)
+	{
+		fprintf(stderr, "No more than %d outputs\n", MAX_OUTPUTS);
+		return (-1);
+	}
+	memset(p, 0, sizeof(*p));
+	p->read 	= read;
+	p->ctx 		= ctx;
+	p->nrows 	= nrows;
+	p->nout 	= nout;
+	p->in_slot 	= -1;
+
+	rows = (insize < CHUNK_BYTES)? CHUNK_BYTES / insize : 1;
+	if (rows > nrows)
+		rows = (nrows > 0)? nrows : 1;
+	if (ring_init(&p->inq, insize, rows))
+	{
+		fprintf(stderr, "No space for the read ahead buffers\n");
+		return (-1);
+	}
+	for (k = 0; k < nout; k++)
+	{
+		p->w[k].out  = out[k];
+		p->w[k].slot = -1;
+		if (ring_init(&p->w[k].q, outsize, rows))
+		{
+			fprintf(stderr, "No space for the write behind buffers\n");
+			while (k-- > 0)
+				ring_free(&p->w[k].q);
+			ring_free(&p->inq);
+			return (-1);
+		}
+	}
+	if (pthread_create(&p->reader, NULL, reader_thread, p))
+	{
+		fprintf(stderr, "Can't start the read ahead thread\n");
+		for (k = 0; k < nout; k++)
+			ring_free(&p->w[k].q);
+		ring_free(&p->inq);
+		return (-1);
+	}
+	for (k = 0; k < nout; k++)
+		if (pthread_create(&p->w[k].thread, NULL, writer_thread, &p->w[k]))
+		{
+			fprintf(stderr, "Can't start the write behind threads\n");
+			p->nout = k;
+			(void) pipeline_close(p);
+			while (k < nout)
+				ring_free(&p->w[k++].q);
+			return (-1);
+		}
+	return (0);
+}
+
+/****************************************************************************************************/
+/* pipe_read returns the next input line, and in outline[] where to put the matching line of each	*/
+/* output. Returns NULL at the end of the image, or on a read or write error.						*/
+/****************************************************************************************************/
+void *pipe_read(pipeline *p, void **outline)
+{
+	int k;
+
+	while (p->in_slot < 0 || p->in_pos == p->in_count)
+	{
+		if (p->in_slot >= 0)
+			ring_give(&p->inq);
+		p->in_pos 	= 0;
+		p->in_slot 	= ring_wait_full(&p->inq, &p->in_count);
+		if (p->in_slot < 0)
+			return (NULL);
+	}
+	for (k = 0; k < p->nout; k++)
+	{
+		if (p->w[k].slot < 0)
+		{
+			p->out_pos 	= 0;
+			p->w[k].slot = ring_wait_free(&p->w[k].q);
+			if (p->w[k].slot < 0)
+				return (NULL);
+		}
+		outline[k] = ring_line(&p->w[k].q, p->w[k].slot, p->out_pos);
+	}
+	return (ring_line(&p->inq, p->in_slot, p->in_pos++));
+}
+
+/****************************************************************************************************/
+/* pipe_write queues the output lines given by the last pipe_read. A failed writer is seen by the	*/
+/* next pipe_read.																					*/
+/****************************************************************************************************/
+int pipe_write(pipeline *p)
+{
+	int k;
+
+	if (p->nout == 0 || p->w[0].slot < 0)
+		return (-1);
+	if (++p->out_pos == p->w[0].q.rows)
+	{
+		for (k = 0; k < p->nout; k++)
+		{
+			ring_put(&p->w[k].q, p->w[k].slot, p->out_pos);
+			p->w[k].slot = -1;
+		}
+	}
+	return (0);
+}
+
+/****************************************************************************************************/
+/* pipeline_close flushes what is left to the writers and waits for all the threads.				*/
+/* Returns 0 if every line was read, and written to every output.									*/
+/****************************************************************************************************/
+int pipeline_close(pipeline *p)
+{
+	int k, ok;
+
+	ring_end(&p->inq, 1);
+	pthread_join(p->reader, NULL);
+	ok = !p->rerr;
+	for (k = 0; k < p->nout; k++)
+	{
+		if (p->w[k].slot >= 0 && p->out_pos > 0)
+			ring_put(&p->w[k].q, p->w[k].slot, p->out_pos);
+		ring_end(&p->w[k].q, 0);
+		pthread_join(p->w[k].thread, NULL);
+		ring_free(&p->w[k].q);
+		ok = ok && !p->w[k].err && p->w[k].written == p->nrows;
+	}
+	ring_free(&p->inq);
+	return (ok? 0 : -1);
+}
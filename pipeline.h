@@ -0,0 +1,73 @@
+/* $Id$ */
+
+/*
+ * Read-ahead / write-behind pipeline for the CST tiff tools.
+ *
+ * A reader thread fills input lines ahead of the processing, and a writer
+ * thread per output drains the processed lines to it, so that the disk and the
+ * cpu are kept busy at the same time. The stages are linked by bounded rings
+ * of chunks of lines; the processing loop itself still works a line at a time:
+ *
+ *	while ((inputline = pipe_read(&p, &outline)) != NULL)
+ *	{
+ *		... outline from inputline ...
+ *		pipe_write(&p);
+ *	}
+ *	ret = pipeline_close(&p);
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <tiffio.h>
+
+#define	RING_SLOTS	4			/* # chunks in flight between two stages */
+#define	CHUNK_BYTES	(1L<<20)	/* aim for chunks of about this many bytes of input */
+#define	MAX_OUTPUTS	8
+
+typedef int (*linereader)(void *, void *, uint32);
+
+typedef struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	uint8		*buf;
+	size_t		linesize;
+	uint32		rows;				/* # lines in a chunk */
+	uint32		count[RING_SLOTS];	/* # lines held by each chunk */
+	uint32		put, got;			/* # chunks filled and emptied so far */
+	int			done;				/* no more chunks will be filled */
+	int			stop;				/* no more chunks will be emptied */
+} ring;
+
+typedef struct pipeline pipeline;
+
+typedef struct {
+	TIFF		*out;
+	ring		q;
+	pthread_t	thread;
+	int			err;
+	uint32		written;	/* # lines written to out */
+	int			slot;		/* chunk being filled by the processing */
+} writer;
+
+struct pipeline {
+	linereader	read;		/* reads line 'row' of the input */
+	void		*ctx;		/* handed to read */
+	uint32		nrows;
+	ring		inq;
+	pthread_t	reader;
+	int			rerr;
+	int			nout;		/* 0 if there is nothing to write */
+	writer		w[MAX_OUTPUTS];
+	int			in_slot;
+	uint32		in_pos, in_count, out_pos;
+};
+
+extern	int  pipeline_open(pipeline *, linereader, void *, size_t, uint32, TIFF **, int, size_t);
+extern	void *pipe_read(pipeline *, void **);		/* one output line per output */
+extern	int  pipe_write(pipeline *);
+extern	int  pipeline_close(pipeline *);
+
+#endif /* PIPELINE_H */
@@ -8,6 +8,8 @@
  *
  * tiffdiff [-h] input1 input2 output
  *     -r n		- create output with n rows/strip of data
+ *     -crop x,y,w,h	- only compare the w x h region at x,y
+ *     -8		- write a BigTIFF (done anyway if the output is over 4GB)
  *
  */
 
@@ -20,30 +22,50 @@
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#include <getopt.h>
 
 #include <tiffio.h>
 
+#include "tiffregion.h"
+#include "pipeline.h"
+
 #define	COLOR_DEPTH	16
 #define	CopyField(tag, v) if (TIFFGetField(in, tag, &v)) TIFFSetField(out, tag, v)
 
 static	void usage(void);
-static 	int  prepare_images(TIFF *, TIFF *, TIFF *, uint32);
-static 	void diff_image16(TIFF *, TIFF *, TIFF *);
+static 	int  prepare_images(TIFF *, TIFF *, TIFF *, uint32, region *);
+static 	int  diff_image16(regionreader *, TIFF *);
+static 	int  readlines(void *, void *, uint32);
+
+static struct option long_opts[] = {
+	{"crop", required_argument, NULL, 'c'},
+	{NULL, 0, NULL, 0}
+};
 
 
 /****************************************************************************************************/
 int
 main(int argc, char* argv[])
 {
-	int c;
+	int c, ret, bigtiff = 0;
+	uint16	bps, spp;
 	uint32	rowsperstrip = (uint32) -1;
 	TIFF	*in, *in2, *out;
+	regionreader rr[2];
+	region	crop = {0, 0, 0, 0};
 
-	while ((c = getopt(argc, argv, "r:")) != -1)
+	while ((c = getopt_long_only(argc, argv, "r:c:8", long_opts, NULL)) != -1)
 		switch (c) {
 		case 'r':		/* rows/strip */
 			rowsperstrip = atoi(optarg);
 			break;
+		case 'c':		/* region of interest */
+			if (parse_region(optarg, &crop))
+				usage();
+			break;
+		case '8':
+			bigtiff = 1;
+			break;
 		case '?':
 			usage();
 			/*NOTREACHED*/
@@ -61,24 +83,32 @@ main(int argc, char* argv[])
 	if (in2 == NULL)
 		return (-1);
 
-	out = TIFFOpen(argv[optind+2], "w");
+	/* both inputs have the same size so the regions match */
+	if (region_open(&rr[0], in, &crop, argv[optind]) || region_open(&rr[1], in2, &crop, argv[optind+1]))
+		return(-3);
+
+	TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bps);
+	TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	out = open_output(argv[optind+2], &rr[0].r, spp, bps, bigtiff);
 	if (out == NULL)
 		return (-2);
 	
 	/* Prepare them */
-	if (prepare_images(in, in2, out, rowsperstrip))
+	if (prepare_images(in, in2, out, rowsperstrip, &rr[0].r))
 		return(-3);
 	
-	diff_image16(in, in2, out);
+	ret = diff_image16(rr, out);
 	
+	region_close(&rr[0]);
+	region_close(&rr[1]);
 	(void) TIFFClose(out);
-	return (0);
+	return (ret);
 }
 
 /****************************************************************************************************/
-/* prepare_image prepares the output image.															*/
+/* prepare_image prepares the output image, which has the size of the region r.					*/
 /****************************************************************************************************/
-int prepare_images(TIFF *in, TIFF *in2, TIFF *out, uint32 rowsperstrip)
+int prepare_images(TIFF *in, TIFF *in2, TIFF *out, uint32 rowsperstrip, region *r)
 {
 	float floatv;
 	uint32 longv;
@@ -127,7 +157,8 @@ int prepare_images(TIFF *in, TIFF *in2, TIFF *out, uint32 rowsperstrip)
 	}
 
 	CopyField(TIFFTAG_SUBFILETYPE, longv);
-	CopyField(TIFFTAG_IMAGEWIDTH, longv);
+	TIFFSetField(out, TIFFTAG_IMAGEWIDTH, r->w);
+	TIFFSetField(out, TIFFTAG_IMAGELENGTH, r->h);
 	TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, bitspersample);
 		
 	CopyField(TIFFTAG_PHOTOMETRIC, shortv);
@@ -148,28 +179,37 @@ int prepare_images(TIFF *in, TIFF *in2, TIFF *out, uint32 rowsperstrip)
 }	
 
 /****************************************************************************************************/
-static void diff_image16(TIFF *in, TIFF *in2, TIFF *out)
+/* readlines reads line 'which' of both inputs, one after the other, for the read ahead thread.		*/
+/****************************************************************************************************/
+static int readlines(void *ctx, void *line, uint32 which)
+{
+	regionreader *rr = (regionreader *) ctx;
+
+	if (region_readline(&rr[0], line, which) <= 0)	
+		return (-1);
+	return (region_readline(&rr[1], (uint8 *) line + (size_t) rr[0].r.w * rr[0].pixsize, which));
+}
+
+/****************************************************************************************************/
+/* diff_image16 takes the difference of the regions of the two inputs rr[0] and rr[1].			*/
+/* Returns 0 if the whole region was processed.														*/
+/****************************************************************************************************/
+static int diff_image16(regionreader *rr, TIFF *out)
 {
-	uint16 *outline, *inputline, *inputline2, i, j;
+	uint16 *outline, *inputline, *inputline2;
+	uint32	j;
 	uint16	*outptr, *inptr, *inptr2;
 	int32 l1, l2;
 	uint32	imagewidth;
-	uint32	imagelength;
+	pipeline p;
 
-		
-	//printf("Scanline is %d %d\n", TIFFScanlineSize(in), TIFFScanlineSize(out));
-	inputline 	= (uint16 *) _TIFFmalloc(TIFFScanlineSize(in));
-	inputline2 	= (uint16 *) _TIFFmalloc(TIFFScanlineSize(in2));
-	outline 	= (uint16 *) _TIFFmalloc(TIFFScanlineSize(out));
-	TIFFGetField(in2, TIFFTAG_IMAGEWIDTH, &imagewidth);
-	TIFFGetField(in2, TIFFTAG_IMAGELENGTH, &imagelength);
+	imagewidth 	= rr->r.w;
+	if (pipeline_open(&p, readlines, rr, 2 * TIFFScanlineSize(out), rr->r.h, &out, 1, TIFFScanlineSize(out)))
+		return (-8);
 	
-	for (i = 0; i < imagelength; i++) 
+	while ((inputline = (uint16 *) pipe_read(&p, (void **) &outline)) != NULL) 
 	{
-		if (TIFFReadScanline(in, inputline, i, 0) <= 0)	
-			break;						
-		if (TIFFReadScanline(in2, inputline2, i, 0) <= 0)	
-			break;						
+		inputline2 = (uint16 *) ((uint8 *) inputline + (size_t) rr->r.w * rr->pixsize);
 		inptr = inputline;
 		inptr2 = inputline2;
 		outptr = outline;
@@ -185,12 +225,9 @@ static void diff_image16(TIFF *in, TIFF *in2, TIFF *out)
 			l2 = *inptr2++;
 			*outptr++ = abs(l1 - l2);
 		}
-		if (TIFFWriteScanline(out, outline, i, 0) < 0)
-			break;
+		pipe_write(&p);
 	}
-	_TIFFfree(inputline);
-	_TIFFfree(inputline2);
-	_TIFFfree(outline);
+	return (pipeline_close(&p)? -8 : 0);
 }
 
 /****************************************************************************************************/
@@ -198,6 +235,8 @@ char* stuff[] = {
 "usage: tiffdiff [options] input.tif input2.tif output.tif",
 "where options are:",
 " -r #		make each strip have no more than # rows",
+" -crop x,y,w,h	only compare the w x h region at x,y (also -c x,y,w,h)",
+" -8		write a BigTIFF (done anyway when the output is over 4GB)",
 "",
 NULL
 };
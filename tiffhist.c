@@ -6,7 +6,7 @@
  * CST (2007) (contact roneil@cst.fr)
  *
  * Usage:
- * tiffhist input
+ * tiffhist [-crop x,y,w,h] input
  *
  */
 
@@ -17,34 +17,49 @@
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#include <getopt.h>
 
 #include <tiffconf.h>
 #include <tiffio.h>
 
+#include "tiffregion.h"
+#include "pipeline.h"
+
 #define	B_DEPTH		16		/* # bits/pixel to use */
 #define	B_LEN		(1L<<B_DEPTH)
 
-uint32	hist_red[B_LEN];
-uint32	hist_green[B_LEN];
-uint32	hist_blue[B_LEN];
+uint64_t	hist_red[B_LEN];
+uint64_t	hist_green[B_LEN];
+uint64_t	hist_blue[B_LEN];
 
-static  int  readline(TIFF *, uint16 *, int);
-static	void get_histogram(TIFF*, int);
+static  int  readline(void *, void *, uint32);
+static	int  get_histogram(regionreader *, int);
 static	void usage(void);
 
+static struct option long_opts[] = {
+	{"crop", required_argument, NULL, 'c'},
+	{NULL, 0, NULL, 0}
+};
+
 /****************************************************************************************************/
 int main(int argc, char* argv[])
 {
 	TIFF	*in;
+	regionreader rr;
+	region	crop = {0, 0, 0, 0};
 	uint i, div;
 	uint32 b_len;
 	int c;
 	uint16	bitspersample = 1;
 	uint16	samplesperpixel;
 
-	while ((c = getopt(argc, argv, "")) != -1)
+	while ((c = getopt_long_only(argc, argv, "c:", long_opts, NULL)) != -1)
 		switch (c) 
 		{
+		case 'c':		/* region of interest */
+			if (parse_region(optarg, &crop))
+				usage();
+			break;
 		case '?':
 			usage();
 			/*NOTREACHED*/
@@ -75,71 +90,61 @@ int main(int argc, char* argv[])
 	b_len = 1L<<bitspersample;
 	
 	/* compute the histogram */
-	get_histogram(in, b_len);
+	if (region_open(&rr, in, &crop, argv[optind]))
+		return (-6);
+	if (get_histogram(&rr, b_len))
+		return (-8);
+	region_close(&rr);
 	
 	/* and print the values out */
 	div = (bitspersample == 8)? 1.0 : 16.0;
 	for (i = 0; i < b_len; i++)
-		printf("%f %d %d %d\n", (float)i/div, hist_red[i], hist_green[i], hist_blue[i]);
+		printf("%f %llu %llu %llu\n", (float)i/div, (unsigned long long) hist_red[i],
+			   (unsigned long long) hist_green[i], (unsigned long long) hist_blue[i]);
 		
 	(void) TIFFClose(in);
 	return (0);
 }
 
 /****************************************************************************************************/
-/* readline converts an 8 bit line to 16 bits otherwise returns after reading line.					*/
+/* readline reads a line of the region, converting an 8 bit line to 16 bits.						*/
+/* The 8 bit samples are widened in place, from the end of the line backwards.						*/
+/* It is run by the read ahead thread of the pipeline.												*/
 /****************************************************************************************************/
-static int readline(TIFF *in, uint16 *line, int which)
+static int readline(void *ctx, void *buf, uint32 which)
 {
-	uint16 bps, i;
+	regionreader *rr = (regionreader *) ctx;
+	uint16 *line = (uint16 *) buf;
+	uint16 bps;
+	size_t i;
+	uint8 *sp;
 	
-	TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bps);
+	TIFFGetField(rr->tif, TIFFTAG_BITSPERSAMPLE, &bps);
 
-	if (bps == 16)
-	{
-		if (TIFFReadScanline(in, line, which, 0) <= 0)
-			return (-1);
-	}
-	else
+	if (region_readline(rr, line, which) <= 0)
+		return (-1);
+	if (bps == 8)
 	{
-		uint8 *sline, *sp;
-		uint16 *ptr;
-		uint32 width;
-		
-		TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &width);
-		sline 	= (uint8 *) _TIFFmalloc(TIFFScanlineSize(in));
-		if (TIFFReadScanline(in, sline, which, 0) <= 0)
-			return (-1);
-		sp = sline;
-		ptr= line;
-		for (i = 0; i < width; i++)
-		{
-			*ptr++ = *sp++ ;
-			*ptr++ = *sp++ ;
-			*ptr++ = *sp++ ;
-		}
-		_TIFFfree(sline);
-		 
+		sp = (uint8 *) line;
+		for (i = (size_t) rr->r.w * 3; i-- > 0;)
+			line[i] = sp[i];
 	}
 	return (1);
 }
 /****************************************************************************************************/
-static void get_histogram(TIFF* in, int b_len)
+/* get_histogram counts the values of the region. Returns 0 if the whole region was read.			*/
+/****************************************************************************************************/
+static int get_histogram(regionreader *rr, int b_len)
 {
 	uint16 red, green, blue;
 	uint16 *inputline, *inptr;
 	uint32 j, i;
 	uint32	imagewidth;
-	uint32	imagelength;
+	pipeline p;
 
-	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &imagewidth);
-	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &imagelength);
-	inputline = (uint16 *)_TIFFmalloc(TIFFScanlineSize(in));
-	if (inputline == NULL) 
-	{
-		fprintf(stderr, "No space for scanline buffer\n");
-		exit(-1);
-	}
+	imagewidth 	= rr->r.w;
+	if (pipeline_open(&p, readline, rr, (size_t) imagewidth * 3 * sizeof(uint16), rr->r.h, NULL, 0, 0))
+		return (-1);
 
 	for (i = b_len; i-- > 0;)
 	{
@@ -148,10 +153,8 @@ static void get_histogram(TIFF* in, int b_len)
 		hist_blue[i] 	= 0;
 	}
 	
-	for (i = 0; i < imagelength; i++) 
+	while ((inputline = (uint16 *) pipe_read(&p, NULL)) != NULL) 
 	{
-		if (readline(in, inputline, i) <= 0)
-			break;
 		inptr = inputline;
 		for (j = imagewidth; j-- > 0;) 
 		{
@@ -164,7 +167,7 @@ static void get_histogram(TIFF* in, int b_len)
 		}
 	}
 	
-	_TIFFfree(inputline);
+	return (pipeline_close(&p));
 }
 
 
@@ -172,7 +175,7 @@ static void get_histogram(TIFF* in, int b_len)
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: tiffhisto input.tif\n");
+	fprintf(stderr, "usage: tiffhisto [-crop x,y,w,h] input.tif\n");
 	exit(-1);
 }
 
@@ -0,0 +1,288 @@
+/* $Id$ */
+
+/*
+ * Region of interest reading for the CST tiff tools.
+ *
+ * Only the strips or tiles which intersect the region are decoded, and only
+ * the columns inside the region are handed back, so the cost of a crop is in
+ * proportion to its size and not to the size of the whole frame. All offsets are
+ * done in 64 bits so frames of any size (BigTIFF included) can be read.
+ * The kernel is asked to start reading the next few strips while we decode
+ * the current one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <tiffconf.h>
+#include <tiffio.h>
+
+#include "tiffregion.h"
+#include "pipeline.h"
+
+#define	NO_BLOCK	((uint32) -1)
+#define	MAX_BLOCK	((tmsize_t) 64 << 20)		/* largest strip we decode in one go */
+#define	READ_AHEAD	((uint64) 2 * RING_SLOTS * CHUNK_BYTES)	/* # bytes of the file to prefetch, twice the read ahead ring */
+#define	MAX_CLASSIC	(((uint64_t) 1 << 32) - ((uint64_t) 64 << 20))	/* room left for the tags */
+
+static	int  load_block(regionreader *, uint32);
+static	void prefetch(regionreader *, uint32);
+static	uint64 block_bytes(regionreader *, uint32, int);
+
+/****************************************************************************************************/
+/* parse_region reads a region given as x,y,w,h. Returns 0 if ok.									*/
+/****************************************************************************************************/
+int parse_region(const char *str, region *r)
+{
+	unsigned long x, y, w, h;
+	char c;
+
+	/* %lu would take -1 as a huge number */
+	if (strchr(str, '-') != NULL || sscanf(str, "%lu,%lu,%lu,%lu%c", &x, &y, &w, &h, &c) != 4 || w == 0 || h == 0 ||
+		x > 0xffffffffUL || y > 0xffffffffUL || w > 0xffffffffUL || h > 0xffffffffUL)
+	{
+		fprintf(stderr, "Bad region '%s', must be x,y,w,h\n", str);
+		return (-1);
+	}
+	r->x = (uint32) x;
+	r->y = (uint32) y;
+	r->w = (uint32) w;
+	r->h = (uint32) h;
+	return (0);
+}
+
+/****************************************************************************************************/
+/* region_open readies a reader for the region r of the image (the whole image if r is NULL).		*/
+/* A region with no width or height goes to the edge of the image, otherwise it is an error for	*/
+/* it not to fit in the image: a scope extraction must have exactly the size asked for.				*/
+/****************************************************************************************************/
+int region_open(regionreader *rr, TIFF *in, const region *r, const char *im)
+{
+	uint32	width, length;
+	uint16	bps, spp;
+
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &width);
+	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &length);
+	TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bps);
+	TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+
+	memset(rr, 0, sizeof(*rr));
+	rr->tif = in;
+	if (r != NULL)
+		rr->r = *r;
+	if (rr->r.x >= width || rr->r.y >= length)
+	{
+		fprintf(stderr, "%s: Region starts outside of the %ux%u image\n", im, width, length);
+		return (-6);
+	}
+	if ((uint64) rr->r.x + rr->r.w > width || (uint64) rr->r.y + rr->r.h > length)
+	{
+		fprintf(stderr, "%s: %ux%u region at %u,%u does not fit in the %ux%u image\n", im,
+				rr->r.w, rr->r.h, rr->r.x, rr->r.y, width, length);
+		return (-6);
+	}
+	if (rr->r.w == 0)
+		rr->r.w = width - rr->r.x;
+	if (rr->r.h == 0)
+		rr->r.h = length - rr->r.y;
+
+	rr->pixsize = (bps / 8) * spp;
+	rr->tiled 	= TIFFIsTiled(in);
+	rr->block 	= NO_BLOCK;
+	rr->last 	= NO_BLOCK;
+	rr->ahead 	= NO_BLOCK;
+	if (rr->tiled)
+	{
+		TIFFGetField(in, TIFFTAG_TILEWIDTH, &rr->tw);
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &rr->blen);
+		rr->tfirst 	= rr->r.x / rr->tw;
+		rr->tcount 	= (rr->r.x + rr->r.w - 1) / rr->tw - rr->tfirst + 1;
+		rr->rowsize = TIFFTileRowSize(in);
+		rr->bsize 	= TIFFTileSize(in);
+		rr->buf 	= (uint8 *) _TIFFmalloc(rr->bsize * rr->tcount);
+	}
+	else
+	{
+		TIFFGetFieldDefaulted(in, TIFFTAG_ROWSPERSTRIP, &rr->blen);
+		if (rr->blen > length)
+			rr->blen = length;
+		rr->rowsize = TIFFScanlineSize(in);
+		rr->bsize 	= TIFFStripSize(in);
+		if (rr->bsize > MAX_BLOCK)
+		{
+			/* e.g. a whole compressed frame in one strip */
+			rr->scanline = 1;
+			rr->rps 	= rr->blen;
+			rr->blen 	= 1;
+			rr->bsize 	= rr->rowsize;
+		}
+		rr->buf 	= (uint8 *) _TIFFmalloc(rr->bsize);
+	}
+	if (rr->buf == NULL)
+	{
+		fprintf(stderr, "%s: No space for strip buffer\n", im);
+		return (-7);
+	}
+	return (0);
+}
+
+/****************************************************************************************************/
+/* load_block decodes strip number 'block', or all the tiles of tile row 'block' that touch the		*/
+/* region, or scanline 'block', into the reader's buffer.											*/
+/****************************************************************************************************/
+static int load_block(regionreader *rr, uint32 block)
+{
+	uint32 i, row;
+
+	rr->block = NO_BLOCK;
+	prefetch(rr, block);
+	if (rr->tiled)
+	{
+		for (i = 0; i < rr->tcount; i++)
+			if (TIFFReadTile(rr->tif, rr->buf + i * rr->bsize, (rr->tfirst + i) * rr->tw, block * rr->blen, 0, 0) < 0)
+				return (-1);
+	}
+	else if (rr->scanline)
+	{
+		/* most codecs can not seek, so decode our way down from the last row or the strip start */
+		row = block - block % rr->rps;
+		if (rr->last != NO_BLOCK && rr->last >= row && rr->last < block)
+			row = rr->last + 1;
+		for (; row <= block; row++)
+			if (TIFFReadScanline(rr->tif, rr->buf, row, 0) <= 0)
+				return (-1);
+		rr->last = block;
+	}
+	else
+	{
+		if (TIFFReadEncodedStrip(rr->tif, block, rr->buf, (tmsize_t) -1) < 0)
+			return (-1);
+	}
+	rr->block = block;
+	return (0);
+}
+
+/****************************************************************************************************/
+/* block_bytes returns the # bytes in the file of strip 'block', or of the tiles of tile row 'block'	*/
+/* that touch the region. With advise set, also tells the kernel we will soon want them.			*/
+/****************************************************************************************************/
+static uint64 block_bytes(regionreader *rr, uint32 block, int advise)
+{
+	uint32	i, n, s;
+	uint64	off, len, total = 0;
+
+	n = rr->tiled? rr->tcount : 1;
+	for (i = 0; i < n; i++)
+	{
+		s 	= rr->tiled? TIFFComputeTile(rr->tif, (rr->tfirst + i) * rr->tw, block * rr->blen, 0, 0) : block;
+		len = TIFFGetStrileByteCount(rr->tif, s);
+		total += len;
+#if defined(POSIX_FADV_WILLNEED)
+		if (advise && (off = TIFFGetStrileOffset(rr->tif, s)) != 0)
+			posix_fadvise(TIFFFileno(rr->tif), (off_t) off, (off_t) len, POSIX_FADV_WILLNEED);
+#else
+		(void) off;
+		(void) advise;
+#endif
+	}
+	return (total);
+}
+
+/****************************************************************************************************/
+/* prefetch tells the kernel we will soon want the strips (or the tiles of the region) following	*/
+/* 'block', so they are on their way while we decode this one. The window is READ_AHEAD bytes of	*/
+/* the file, however small the strips are, so that it covers the latency of network storage.		*/
+/****************************************************************************************************/
+static void prefetch(regionreader *rr, uint32 block)
+{
+	uint32	next, last;
+	uint64	len;
+
+	if (rr->scanline || TIFFFileno(rr->tif) < 0)
+		return;
+
+	/* this block leaves the window */
+	if (rr->ahead != NO_BLOCK && block <= rr->ahead)
+	{
+		len = block_bytes(rr, block, 0);
+		rr->pending = (len < rr->pending)? rr->pending - len : 0;
+		next = rr->ahead + 1;
+	}
+	else
+	{
+		rr->pending = 0;
+		next = block + 1;
+	}
+
+	last = (rr->r.y + rr->r.h - 1) / rr->blen;
+	for (; rr->pending < READ_AHEAD && next <= last; next++)
+	{
+		rr->pending += block_bytes(rr, next, 1);
+		rr->ahead = next;
+	}
+}
+
+/****************************************************************************************************/
+/* region_readline copies row 'which' of the region (0 is the top row of the region) to line.		*/
+/* line must hold r.w pixels. The samples are left as they are in the file.							*/
+/****************************************************************************************************/
+int region_readline(regionreader *rr, void *line, uint32 which)
+{
+	uint32	y, x0, x1, tx, i;
+	uint8	*src, *dst = (uint8 *) line;
+
+	if (which >= rr->r.h)
+		return (-1);
+	y = rr->r.y + which;
+	if (y / rr->blen != rr->block && load_block(rr, y / rr->blen) < 0)
+		return (-1);
+
+	src = rr->buf + (tmsize_t)(y % rr->blen) * rr->rowsize;
+	if (!rr->tiled)
+	{
+		memcpy(dst, src + (tmsize_t) rr->r.x * rr->pixsize, (size_t) rr->r.w * rr->pixsize);
+		return (1);
+	}
+
+	for (i = 0; i < rr->tcount; i++)
+	{
+		tx = (rr->tfirst + i) * rr->tw;
+		x0 = (rr->r.x > tx)? rr->r.x : tx;
+		x1 = (rr->r.x + rr->r.w < tx + rr->tw)? rr->r.x + rr->r.w : tx + rr->tw;
+		memcpy(dst + (tmsize_t)(x0 - rr->r.x) * rr->pixsize,
+			   src + i * rr->bsize + (tmsize_t)(x0 - tx) * rr->pixsize,
+			   (size_t)(x1 - x0) * rr->pixsize);
+	}
+	return (1);
+}
+
+/****************************************************************************************************/
+void region_close(regionreader *rr)
+{
+	if (rr->buf != NULL)
+		_TIFFfree(rr->buf);
+	rr->buf = NULL;
+}
+
+/****************************************************************************************************/
+/* open_output opens the output image for the region r with spp samples of bps bits. A BigTIFF is	*/
+/* written if asked for (big), or if the image data would not fit in a classic TIFF.				*/
+/****************************************************************************************************/
+TIFF *open_output(const char *name, const region *r, uint16 spp, uint16 bps, int big)
+{
+	uint64_t bytes = (uint64_t) r->w * r->h * spp * (bps / 8);
+
+#ifdef TIFF_BIGTIFF_VERSION
+	if (big || bytes > MAX_CLASSIC)
+		return (TIFFOpen(name, "w8"));
+#else
+	if (big || bytes > MAX_CLASSIC)
+	{
+		fprintf(stderr, "%s: This libtiff can not write BigTIFF files\n", name);
+		return (NULL);
+	}
+#endif
+	return (TIFFOpen(name, "w"));
+}
@@ -0,0 +1,50 @@
+/* $Id$ */
+
+/*
+ * Region of interest reading for the CST tiff tools.
+ *
+ * A region reader hands back the scanlines of a rectangle of the input image,
+ * decoding only the strips (or tiles) which intersect that rectangle and
+ * copying only the columns that fall inside it. Memory use is bounded by one strip
+ * (or row of tiles), or by one scanline when the strips are too big, whatever the
+ * size of the frame.
+ */
+
+#ifndef TIFFREGION_H
+#define TIFFREGION_H
+
+#include <stdint.h>
+#include <tiffio.h>
+
+typedef struct {
+	uint32	x, y;		/* top left corner of the region */
+	uint32	w, h;		/* size of the region, 0 means up to the image edge */
+} region;
+
+typedef struct {
+	TIFF	*tif;
+	region	r;
+	uint32	pixsize;	/* # bytes/pixel */
+	int		tiled;
+	int		scanline;	/* strips too big to hold, read a scanline at a time */
+	uint32	blen;		/* rows/strip or tile length */
+	uint32	rps;		/* rows/strip of the file when reading scanlines */
+	uint32	tw;			/* tile width */
+	uint32	tfirst;		/* first tile column touching the region */
+	uint32	tcount;		/* # tile columns touching the region */
+	tmsize_t rowsize;	/* # bytes in one row of a decoded strip or tile */
+	tmsize_t bsize;		/* # bytes in one decoded strip or tile */
+	uint8	*buf;		/* the decoded strip, or row of tiles */
+	uint32	block;		/* strip, tile row or scanline held in buf */
+	uint32	last;		/* last scanline decoded */
+	uint32	ahead;		/* last strip or tile row prefetched */
+	uint64	pending;	/* # bytes prefetched and not yet decoded */
+} regionreader;
+
+extern	int  parse_region(const char *, region *);
+extern	int  region_open(regionreader *, TIFF *, const region *, const char *);
+extern	int  region_readline(regionreader *, void *, uint32);
+extern	void region_close(regionreader *);
+extern	TIFF *open_output(const char *, const region *, uint16, uint16, int);
+
+#endif /* TIFFREGION_H */
@@ -5,12 +5,20 @@
  *
  *	Author: Rip O'Neil, CST, France.
  *
- * toXYZ input output
+ * toXYZ input [output]
  *     -r n		- create output with n rows/strip of data
  *	   -g input_gamma - set the impout gamma. Defaults to 2.6
  *	   -S 			- use the StEM matrix
  *     -1 			- use an identity matrix
  *	   -p 			- use power function for gamma conversion
+ *	   -l n			- make the output LUT n times finer than 16 bits (1-256). Defaults to 8
+ *	   -i n			- interpolate a small output LUT of n entries (1-65536) instead
+ *	   -crop x,y,w,h	- only process the w x h region at x,y
+ *	   -M manifest	- skip the conversion if the manifest directory shows it was already done
+ *	   -8			- write a BigTIFF (done anyway if the output is over 4GB)
+ *	   --verify		- also take the output back to RGB and report the round trip error
+ *	   -o matrix,gamma,output - also write output with this matrix (smpte, stem or ident) and
+ *							input gamma, from the same read of the input. May be repeated.
  *	   -v			- print version
  * (by default the rows/strip are taken from the input file)
  *
@@ -42,19 +50,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 # include <unistd.h>
+#include <getopt.h>
 
 #include <tiffconf.h>
 #include <tiffio.h>
 
+#include "tiffregion.h"
+#include "manifest.h"
+#include "pipeline.h"
+#include "lut.h"
+
 #define	COLOR_DEPTH	16
 
-#define	B_DEPTH		16		/* # bits/pixel to use */
-#define	B_LEN		(1L<<B_DEPTH)
 #define P_DEPTH		12		/* actual precision used (12 bits) */
 #define P_LEN		(4096)
-#define PRECISION	8		/* how much more in the linear space do we want over 16 bits... */
 
 /* default gamma values */
 #define GAMMA (2.6)		
@@ -64,9 +76,6 @@
 #define MAT_SMPTE	1
 #define MAT_StEM 	2
 
-/* the LookUpTables for the gamma function  */
-static float 	lut_in[B_LEN];
-static uint16 	lut_out[B_LEN<<PRECISION];
 static int		use_power = 0;
 
 typedef struct {
@@ -75,6 +84,30 @@ typedef struct {
 	float b;
 } pixelf;
 
+/* round trip (RGB->X'Y'Z'->RGB) error statistics, in 16 bit codes */
+typedef struct {
+	float	*decode;		/* X'Y'Z' code -> linear */
+	float	inv[3][3];		/* inverse of the matrix used */
+	float	degamma;		/* 1/input gamma */
+	uint32	max[3];
+	double	sum[3];
+	uint64_t n;
+	uint32	worst, wx, wy;	/* largest error of any channel and where it is */
+	uint16	win[3], wout[3], wback[3];
+} verifystats;
+
+/* one output: how it is made and where it goes */
+typedef struct {
+	int		matrix;
+	float	gamma_in;
+	char	*path;
+	char	*tmp;			/* written here, renamed to path once complete */
+	TIFF	*out;
+	gammalut lut;			/* the LookUpTables for the gamma function  */
+	verifystats vs;
+	char	params[256];	/* for the manifest */
+} variant;
+
 /* the different matrix definitions */
 static float TheMatrix[3][3][3]= {
 /* identity */
@@ -92,44 +125,100 @@ static float TheMatrix[3][3][3]= {
 	  {0.2185, 0.7010, 0.0805},
 	  {0.0000, 0.0457, 0.9087}}
 };
+static const char *matrix_names[3] = {"Identity (1:1)", "SMPTE DC28.30 2006-02-24", "StEM"};
 
 /* Some prototyping */
 static	void usage(void);
-static 	void make_lut(float,float);
 static 	void do_matrix( pixelf *, pixelf *, int );
-static 	void process_image16(TIFF *, TIFF *, int);
-static 	void process_image16p(TIFF *, TIFF *, int, float, float);
-static 	int  prepare_image(TIFF *, TIFF *, char *, uint32 , char *);
-static  int  readline(TIFF *, uint16 *, int);
+static 	int  process_image16(regionreader *, variant *, int, int);
+static 	int  process_image16p(regionreader *, variant *, int, float, int);
+static 	int  parse_variant(char *, variant *);
+static 	int  verify_init(verifystats *, int, float, float, double);
+static 	void verify_pixel(verifystats *, uint16 *, uint16 *, uint32, uint32);
+static 	void verify_report(verifystats *, region *, char *);
+static 	int  check_image(TIFF *, char *);
+static 	void prepare_image(TIFF *, TIFF *, char *, uint32, region *);
+static  int  readline(void *, void *, uint32);
+
+static struct option long_opts[] = {
+	{"crop", required_argument, NULL, 'c'},
+	{"verify", no_argument, NULL, 'V'},
+	{NULL, 0, NULL, 0}
+};
 
 /****************************************************************************************************/
 int main(int argc, char* argv[])
 {
-	TIFF	*in, *out;
+	TIFF	*in;
+	regionreader rr;
+	region	crop = {0, 0, 0, 0};
 	uint32	rpp = (uint32) -1;
 	float gamma_in = GAMMA, gamma_out = DEGAMMA;
-	int c, ret, matrix = MAT_SMPTE;
-	char buf[256], matrix_used[256] = "SMPTE DC28.30 2006-02-24";
+	uint16	spp;
+	int c, k, n, ret, opened = 0, matrix = MAT_SMPTE, bigtiff = 0, verify = 0, nv = 0, nextra = 0;
+	uint32	precision = PRECISION, ninterp = 0;
+	char buf[256];
+	char *manifest = NULL;
+	uint64_t hash = 0;
+	variant	v[MAX_OUTPUTS];
 
-	while ((c = getopt(argc, argv, "r:l:g:1Spv")) != -1)
+	while ((c = getopt_long_only(argc, argv, "r:l:i:g:1Spvc:M:8o:", long_opts, NULL)) != -1)
 		switch (c) {
 		case 'r':		/* rows/strip */
 			rpp = atoi(optarg);
 			break;
+		case 'c':		/* region of interest */
+			if (parse_region(optarg, &crop))
+				usage();
+			break;
 		case 'g':		/* gamma in */
 			sscanf(optarg, "%f", &gamma_in);
 			break;
 		case '1':
-			strcpy(matrix_used, "Identity (1:1)");
 			matrix = MAT_IDENT;
 			break;
 		case 'S':
-			strcpy(matrix_used, "StEM");
 			matrix = MAT_StEM;
 			break;
 		case 'p':
 			use_power = 1;
 			break;
+		case 'l':		/* output LUT precision */
+			n = atoi(optarg);
+			if (n < 1 || n > MAX_PRECISION)
+			{
+				fprintf(stderr, "Precision must be between 1 and %d\n", MAX_PRECISION);
+				usage();
+			}
+			precision = n;
+			break;
+		case 'i':		/* interpolated output LUT */
+			n = atoi(optarg);
+			if (n < 1 || n > MAX_INTERP)
+			{
+				fprintf(stderr, "The interpolated LUT must have between 1 and %d entries\n", MAX_INTERP);
+				usage();
+			}
+			ninterp = n;
+			break;
+		case 'M':		/* incremental mode */
+			manifest = optarg;
+			break;
+		case '8':
+			bigtiff = 1;
+			break;
+		case 'V':		/* round trip check */
+			verify = 1;
+			break;
+		case 'o':		/* another output from the same read */
+			if (nextra == MAX_OUTPUTS - 1)
+			{
+				fprintf(stderr, "No more than %d -o outputs\n", MAX_OUTPUTS - 1);
+				usage();
+			}
+			if (parse_variant(optarg, &v[1 + nextra++]))
+				usage();
+			break;
 		case 'v':
 			fprintf(stderr, "Ver %s \n", VERSION);
 			exit(0);
@@ -137,53 +226,178 @@ int main(int argc, char* argv[])
 			usage();
 			/*NOTREACHED*/
 		}
-	if (argc - optind < 2)
+	if (argc - optind < 1 || (argc - optind < 2 && nextra == 0))
 		usage();
 
+	/* the output given on the command line is made with -g and -1/-S */
+	if (argc - optind >= 2)
+	{
+		v[0].matrix 	= matrix;
+		v[0].gamma_in 	= gamma_in;
+		v[0].path 		= argv[optind+1];
+		nv = 1 + nextra;
+	}
+	else
+	{
+		memmove(&v[0], &v[1], nextra * sizeof(variant));
+		nv = nextra;
+	}
+
+	/* each output has its own writer, and its own manifest entry */
+	for (k = 1; k < nv; k++)
+		for (n = 0; n < k; n++)
+			if (!strcmp(v[k].path, v[n].path))
+			{
+				fprintf(stderr, "%s is given as an output more than once\n", v[k].path);
+				usage();
+			}
+
+	/* In incremental mode skip the frame if neither its content nor the way we transform it changed */
+	if (manifest != NULL)
+	{
+		if (manifest_open(manifest) || hash_file(argv[optind], &hash))
+			return (-1);
+		for (k = 0, ret = 1; k < nv; k++)
+		{
+			sprintf(v[k].params, "v%s,g%.6g,m%d,p%d,l%u,i%u,c%u:%u:%u:%u,r%u,b%d", VERSION, v[k].gamma_in, v[k].matrix,
+					use_power, precision, ninterp, crop.x, crop.y, crop.w, crop.h, rpp, bigtiff);
+			ret = ret && manifest_check(manifest, v[k].path, hash, v[k].params);
+		}
+		if (ret)
+			return (0);
+	}
+
 	/* Open images and ready for data processing */
 	in = TIFFOpen(argv[optind], "r");
 	if (in == NULL)
 		return (-1);
-
-	out = TIFFOpen(argv[optind+1], "w");
-	if (out == NULL)
-		return (-2);
-	
-	sprintf(buf, "RGB->X'Y'Z' photometric interpretation with %4.2f input gamma, 1/%4.2f output gamma, Matrix used: %s", gamma_in, 1/gamma_out, matrix_used); 
-	ret = prepare_image(in, out, buf, rpp, argv[optind]);
+	ret = check_image(in, argv[optind]);
 	if (ret)
 		return(ret);
-	
-	/* do the actual processing of image */
-	if (use_power)
-		process_image16p(in, out, matrix, gamma_in, gamma_out);
-	else
+	ret = region_open(&rr, in, &crop, argv[optind]);
+	if (ret)
+		return(ret);
+
+	for (k = 0; k < nv; k++)
 	{
+		/* the power function output is 12 bits padded out to 16 */
+		if (verify && verify_init(&v[k].vs, v[k].matrix, v[k].gamma_in, gamma_out, use_power? (P_LEN - 1) * 16.0 : B_LEN - 1.0))
+			return (-9);
+
 		/* make LUT for gamma transfers */
-		make_lut(gamma_in, gamma_out);
-		process_image16(in, out, matrix);
+		if (!use_power && lut_make(&v[k].lut, v[k].gamma_in, gamma_out, precision, ninterp))
+			return (-9);
+		v[k].tmp = NULL;
+		v[k].out = NULL;
+	}
+
+	/* never leave a half written frame under the output's name: from here on every failure goes */
+	/* through the cleanup below, which removes what was written */
+	TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	for (k = 0; k < nv; k++, opened++)
+	{
+		v[k].tmp = (char *) malloc(strlen(v[k].path) + sizeof(".part"));
+		if (v[k].tmp == NULL)
+			break;
+		sprintf(v[k].tmp, "%s.part", v[k].path);
+		v[k].out = open_output(v[k].tmp, &rr.r, spp, COLOR_DEPTH, bigtiff);
+		if (v[k].out == NULL)
+			break;
+	
+		sprintf(buf, "RGB->X'Y'Z' photometric interpretation with %4.2f input gamma, 1/%4.2f output gamma, Matrix used: %s", v[k].gamma_in, 1/gamma_out, matrix_names[v[k].matrix]); 
+		prepare_image(in, v[k].out, buf, rpp, &rr.r);
 	}
+
+	/* do the actual processing of image, every output from each line read */
+	if (opened < nv)
+		ret = -2;
+	else if (use_power)
+		ret = process_image16p(&rr, v, nv, gamma_out, verify);
+	else
+		ret = process_image16(&rr, v, nv, verify);
 	
 	/* and do some cleanup */
-	(void) TIFFClose(out);
+	for (k = 0; k < nv; k++)
+	{
+		if (verify && opened == nv)
+			verify_report(&v[k].vs, &rr.r, v[k].path);
+		if (!use_power)
+			lut_free(&v[k].lut);
+		if (v[k].out == NULL)
+			continue;
+		/* the last strip and the directory are only written now: a full disk shows up here */
+		if (ret == 0 && !TIFFFlush(v[k].out))
+		{
+			fprintf(stderr, "Can't write %s\n", v[k].tmp);
+			ret = -10;
+		}
+		(void) TIFFClose(v[k].out);
+	}
+	region_close(&rr);
 	(void) TIFFClose(in);
+
+	/* only complete frames take the place of the outputs, and go in the manifest */
+	for (k = 0; k < nv; k++)
+	{
+		if (ret == 0 && manifest != NULL)
+			manifest_invalidate(manifest, v[k].path);
+		if (ret == 0 && rename(v[k].tmp, v[k].path))
+		{
+			fprintf(stderr, "Can't rename %s to %s\n", v[k].tmp, v[k].path);
+			ret = -10;
+		}
+		if (ret && v[k].tmp != NULL)
+			unlink(v[k].tmp);
+		free(v[k].tmp);
+	}
+	if (ret == 0 && manifest != NULL)
+		for (k = 0; k < nv; k++)
+			manifest_add(manifest, v[k].path, hash, v[k].params);
+	return (ret);
+}
+
+/****************************************************************************************************/
+/* parse_variant reads an output given as matrix,gamma,path. Returns 0 if ok.						*/
+/****************************************************************************************************/
+static int parse_variant(char *str, variant *v)
+{
+	char *gamma, *path;
+
+	memset(v, 0, sizeof(*v));
+	if ((gamma = strchr(str, ',')) == NULL || (path = strchr(gamma + 1, ',')) == NULL || path[1] == '\0')
+	{
+		fprintf(stderr, "Bad output '%s', must be matrix,gamma,output\n", str);
+		return (-1);
+	}
+	if (!strncasecmp(str, "smpte,", 6))
+		v->matrix = MAT_SMPTE;
+	else if (!strncasecmp(str, "stem,", 5))
+		v->matrix = MAT_StEM;
+	else if (!strncasecmp(str, "ident,", 6))
+		v->matrix = MAT_IDENT;
+	else
+	{
+		fprintf(stderr, "Bad matrix in '%s', must be smpte, stem or ident\n", str);
+		return (-1);
+	}
+	if (sscanf(gamma + 1, "%f,", &v->gamma_in) != 1)
+	{
+		fprintf(stderr, "Bad gamma in '%s'\n", str);
+		return (-1);
+	}
+	v->path = path + 1;
 	return (0);
 }
 
 /****************************************************************************************************/
-/* prepare_image prepares the output image.															*/
+/* check_image checks that the input im is something we can convert. Returns 0 if ok.				*/
 /****************************************************************************************************/
-int prepare_image(TIFF *in, TIFF *out, char *str, uint32 rpp, char *im)
+static int check_image(TIFF *in, char *im)
 {
-	char buf[256];
 	uint16	spp;
-	uint32	i_width;
-	uint32	i_length;
 	uint16  bps;
-	uint16 planar, config, photometric;
+	uint16 config, photometric;
 
-	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &i_width);
-	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &i_length);
 	TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bps);
 	TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
 	if (bps != 8 && bps != 16) 
@@ -202,8 +416,22 @@ int prepare_image(TIFF *in, TIFF *out, char *str, uint32 rpp, char *im)
 		fprintf(stderr, "%s: Can only handle contiguous data packing\n", im);
 		return (-5);
 	}
+	return (0);
+}
+
+/****************************************************************************************************/
+/* prepare_image prepares the output image, which has the size of the region r.					*/
+/****************************************************************************************************/
+static void prepare_image(TIFF *in, TIFF *out, char *str, uint32 rpp, region *r)
+{
+	char buf[256];
+	uint16	spp;
+	uint16 planar, photometric;
+
+	TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
 	/* define the size of the output image */
-	TIFFSetField(out, TIFFTAG_IMAGEWIDTH, i_width);
+	TIFFSetField(out, TIFFTAG_IMAGEWIDTH, r->w);
+	TIFFSetField(out, TIFFTAG_IMAGELENGTH, r->h);
 	TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, (short)COLOR_DEPTH);
 	TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, spp);
 	TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, rpp));
@@ -215,43 +443,30 @@ int prepare_image(TIFF *in, TIFF *out, char *str, uint32 rpp, char *im)
 	TIFFSetField(out, TIFFTAG_IMAGEDESCRIPTION, str);
 	sprintf(buf, "toXYZ (Version: %s) (c)2007 CST, France", VERSION); 
 	TIFFSetField(out, TIFFTAG_SOFTWARE, buf);
-	return(0);
 }
 
 /****************************************************************************************************/
-/* readline converts an 8 bit line to 16 bits otherwise returns after reading line.					*/
+/* readline reads a line of the region, converting an 8 bit line to 16 bits.						*/
+/* The 8 bit samples are widened in place, from the end of the line backwards.						*/
+/* It is run by the read ahead thread of the pipeline.												*/
 /****************************************************************************************************/
-static int readline(TIFF *in, uint16 *line, int which)
+static int readline(void *ctx, void *buf, uint32 which)
 {
-	uint16 bps, i;
+	regionreader *rr = (regionreader *) ctx;
+	uint16 *line = (uint16 *) buf;
+	uint16 bps;
+	size_t i;
+	uint8 *sp;
 	
-	TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bps);
+	TIFFGetField(rr->tif, TIFFTAG_BITSPERSAMPLE, &bps);
 
-	if (bps == 16)
-	{
-		if (TIFFReadScanline(in, line, which, 0) <= 0)
-			return (-1);
-	}
-	else
+	if (region_readline(rr, line, which) <= 0)
+		return (-1);
+	if (bps == 8)
 	{
-		uint8 *sline, *sp;
-		uint16 *ptr;
-		uint32 width;
-		
-		TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &width);
-		sline 	= (uint8 *) _TIFFmalloc(TIFFScanlineSize(in));
-		if (TIFFReadScanline(in, sline, which, 0) <= 0)
-			return (-1);
-		sp = sline;
-		ptr= line;
-		for (i = 0; i < width; i++)
-		{
-			*ptr++ = (uint16) *sp++ << 8;
-			*ptr++ = (uint16) *sp++ << 8;
-			*ptr++ = (uint16) *sp++ << 8;
-		}
-		_TIFFfree(sline);
-		 
+		sp = (uint8 *) line;
+		for (i = (size_t) rr->r.w * rr->pixsize; i-- > 0;)
+			line[i] = (uint16) sp[i] << 8;
 	}
 	return (1);
 }
@@ -266,145 +481,249 @@ void do_matrix(pixelf *pi, pixelf *po, int matrix)
 	po->b = (pi->r * TheMatrix[matrix][2][0]) + (pi->g * TheMatrix[matrix][2][1]) + (pi->b * TheMatrix[matrix][2][2]);
 }
 
-/****************************************************************************************************/
-/*  make_lut makes a lut to not have to use the power function on each pixel. */
-/* It assumes a 12 bit precision in log space						*/
-/****************************************************************************************************/
-void make_lut(float g_in, float g_out)
-{
-	uint32 i;
-	
-	for (i = 0; i < B_LEN; i++)
-		lut_in[i]  = powf((float)i/(float)(B_LEN - 1), g_in);
-	
-	for (i = 0; i < B_LEN*PRECISION; i++)
-		lut_out[i] = (uint16)(powf((float)i/(float)(B_LEN*PRECISION - 1), g_out) * (B_LEN - 1));
-
-}
-
 /****************************************************************************************************/
 /*  Do the actual processing of the image line by line.	It assumes a 12 bit precision in log space  */
+/*  Each line read is transformed once for each of the nv outputs.									*/
+/*  Returns 0 if the whole image was processed.														*/
 /****************************************************************************************************/
-static void process_image16(TIFF *in, TIFF *out, int matrix)
+static int process_image16(regionreader *rr, variant *v, int nv, int verify)
 {
 
-	uint32	i_length, i_width;
-	uint16 *outline, *inputline;
+	uint32	i_width, y = 0;
+	uint16 *outline[MAX_OUTPUTS], *inputline;
 	uint16 *outptr, *inptr;
-	uint32 i, j, r, g, b;
+	uint32 j, r, g, b;
 	pixelf pi, po;
+	pipeline p;
+	TIFF	*out[MAX_OUTPUTS];
+	gammalut *lut;
+	int k;
 		
-	TIFFGetField(out, TIFFTAG_IMAGEWIDTH, &i_width);
-	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &i_length);
-	inputline 	= (uint16 *) _TIFFmalloc(TIFFScanlineSize(out));
-	outline 	= (uint16 *) _TIFFmalloc(TIFFScanlineSize(out));
+	i_width 	= rr->r.w;
+	for (k = 0; k < nv; k++)
+		out[k] = v[k].out;
+	if (pipeline_open(&p, readline, rr, TIFFScanlineSize(out[0]), rr->r.h, out, nv, TIFFScanlineSize(out[0])))
+		return (-8);
 
-	for (i = 0; i < i_length; i++) 
+	while ((inputline = (uint16 *) pipe_read(&p, (void **) outline)) != NULL) 
 	{
-		if (readline(in, inputline, i) <= 0)	
-			break;						
-
-		inptr = inputline;
-		outptr = outline;
-		for (j = 0; j < i_width; j++) 
+		for (k = 0; k < nv; k++)
 		{
-			/* bring it into 12 bits Ah... Well not just yet! seems to work better in a 16 bit space*/
-			r = (*inptr++);
-			g = (*inptr++);
-			b = (*inptr++);
-			
-			/* Put into Linear space */
-			pi.r = lut_in[r];
-			pi.g = lut_in[g];
-			pi.b = lut_in[b];
-	
-			/* Perform transform RGB -> XYZ */
-			do_matrix(&pi, &po, matrix);
-			
-			/* put back to the Digital gamma space */
-			r = lut_out[(uint32)(((po.r > 1.0)? 1.0 : po.r) * (B_LEN*PRECISION - 1))];
-			g = lut_out[(uint32)(((po.g > 1.0)? 1.0 : po.g) * (B_LEN*PRECISION - 1))];
-			b = lut_out[(uint32)(((po.b > 1.0)? 1.0 : po.b) * (B_LEN*PRECISION - 1))];
-			
-			/* pad it out to 16 bits Ah... Well not just yet!*/			
-			*outptr++ = (uint16) r;
-			*outptr++ = (uint16) g;
-			*outptr++ = (uint16) b;
+			lut = &v[k].lut;
+			inptr = inputline;
+			outptr = outline[k];
+			for (j = 0; j < i_width; j++) 
+			{
+				/* bring it into 12 bits Ah... Well not just yet! seems to work better in a 16 bit space*/
+				r = (*inptr++);
+				g = (*inptr++);
+				b = (*inptr++);
+				
+				/* Put into Linear space */
+				pi.r = lut->in[r];
+				pi.g = lut->in[g];
+				pi.b = lut->in[b];
+		
+				/* Perform transform RGB -> XYZ */
+				do_matrix(&pi, &po, v[k].matrix);
+				
+				/* put back to the Digital gamma space */
+				r = lut_apply(lut, po.r);
+				g = lut_apply(lut, po.g);
+				b = lut_apply(lut, po.b);
+				
+				/* pad it out to 16 bits Ah... Well not just yet!*/			
+				*outptr++ = (uint16) r;
+				*outptr++ = (uint16) g;
+				*outptr++ = (uint16) b;
+				
+				if (verify)
+					verify_pixel(&v[k].vs, inptr - 3, outptr - 3, rr->r.x + j, rr->r.y + y);
+			}
 		}
-		if (TIFFWriteScanline(out, outline, i, 0) < 0)
-			break;
+		pipe_write(&p);
+		y++;
 	}
-	_TIFFfree(inputline);
-	_TIFFfree(outline);
+	return (pipeline_close(&p)? -8 : 0);
 }
 
 /****************************************************************************************************/
 /*  Do the actual processing of the image line by line.	It assumes a 12 bit precision in log space  */
 /* this uses the power function thus much much slower													*/
 /****************************************************************************************************/
-static void process_image16p(TIFF *in, TIFF *out, int matrix, float g_in, float g_out)
+static int process_image16p(regionreader *rr, variant *v, int nv, float g_out, int verify)
 {
 
-	uint32	i_length, i_width;
-	uint16 *outline, *inputline;
+	uint32	i_width, y = 0;
+	uint16 *outline[MAX_OUTPUTS], *inputline;
 	uint16 *outptr, *inptr;
-	uint32 i, j, r, g, b;
+	uint32 j, r, g, b;
 	pixelf pi, po;
+	pipeline p;
+	TIFF	*out[MAX_OUTPUTS];
+	float	g_in;
+	int k;
 		
-	TIFFGetField(out, TIFFTAG_IMAGEWIDTH, &i_width);
-	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &i_length);
-	inputline 	= (uint16 *) _TIFFmalloc(TIFFScanlineSize(out));
-	outline 	= (uint16 *) _TIFFmalloc(TIFFScanlineSize(out));
+	i_width 	= rr->r.w;
+	for (k = 0; k < nv; k++)
+		out[k] = v[k].out;
+	if (pipeline_open(&p, readline, rr, TIFFScanlineSize(out[0]), rr->r.h, out, nv, TIFFScanlineSize(out[0])))
+		return (-8);
+
+	while ((inputline = (uint16 *) pipe_read(&p, (void **) outline)) != NULL) 
+	{
+		for (k = 0; k < nv; k++)
+		{
+			g_in = v[k].gamma_in;
+			inptr = inputline;
+			outptr = outline[k];
+			for (j = 0; j < i_width; j++) 
+			{
+				/* bring it into 12 bits */
+				r = (*inptr++);
+				g = (*inptr++);
+				b = (*inptr++);
+				
+				/* Put into Linear space */
+				pi.r = powf((float)r/(float)(B_LEN - 1), g_in);
+				pi.g = powf((float)g/(float)(B_LEN - 1), g_in);
+				pi.b = powf((float)b/(float)(B_LEN - 1), g_in);
+				
+				/* Perform transform RGB -> XYZ */
+				do_matrix(&pi, &po, v[k].matrix);
+							
+				/* put back to the Digital gamma space */
+				r = (uint16)(powf(po.r, g_out) * (P_LEN - 1));
+				g = (uint16)(powf(po.g, g_out) * (P_LEN - 1));
+				b = (uint16)(powf(po.b, g_out) * (P_LEN - 1));
+				
+				/* pad it out to 16 bits */			
+				*outptr++ = r * 16;
+				*outptr++ = g * 16 ;
+				*outptr++ = b * 16 ;
+				
+				if (verify)
+					verify_pixel(&v[k].vs, inptr - 3, outptr - 3, rr->r.x + j, rr->r.y + y);
+			}
+		}
+		pipe_write(&p);
+		y++;
+	}
+	return (pipeline_close(&p)? -8 : 0);
+}
 
-	for (i = 0; i < i_length; i++) 
+/****************************************************************************************************/
+/* verify_init readies the inverse transform: scale is the output code of a linear value of 1.0.	*/
+/* Returns 0 if ok.																					*/
+/****************************************************************************************************/
+static int verify_init(verifystats *vs, int matrix, float g_in, float g_out, double scale)
+{
+	float (*m)[3] = TheMatrix[matrix];
+	double det;
+	uint32 i, j;
+
+	memset(vs, 0, sizeof(*vs));
+	det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+		- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+		+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	if (det == 0.0)
+	{
+		fprintf(stderr, "The matrix can not be inverted\n");
+		return (-1);
+	}
+	/* the inverse is the transposed cofactors over the determinant */
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++)
+			vs->inv[j][i] = (m[(i+1)%3][(j+1)%3] * m[(i+2)%3][(j+2)%3]
+						   - m[(i+1)%3][(j+2)%3] * m[(i+2)%3][(j+1)%3]) / det;
+
+	vs->decode = (float *) malloc(B_LEN * sizeof(float));
+	if (vs->decode == NULL)
 	{
-		if (readline(in, inputline, i) <= 0)	
-			break;						
+		fprintf(stderr, "No space for the verify tables\n");
+		return (-1);
+	}
+	for (i = 0; i < B_LEN; i++)
+		vs->decode[i] = (i >= scale)? 1.0f : powf((float)(i / scale), 1 / g_out);
+	vs->degamma = 1 / g_in;
+	return (0);
+}
 
-		inptr = inputline;
-		outptr = outline;
-		for (j = 0; j < i_width; j++) 
+/****************************************************************************************************/
+/* verify_pixel takes an output pixel back to RGB and compares it with the input pixel at (x,y).	*/
+/****************************************************************************************************/
+static void verify_pixel(verifystats *vs, uint16 *in, uint16 *out, uint32 x, uint32 y)
+{
+	float	xyz[3], v;
+	uint16	back[3];
+	uint32	k, err, worst = 0;
+
+	xyz[0] = vs->decode[out[0]];
+	xyz[1] = vs->decode[out[1]];
+	xyz[2] = vs->decode[out[2]];
+	for (k = 0; k < 3; k++)
+	{
+		v = vs->inv[k][0] * xyz[0] + vs->inv[k][1] * xyz[1] + vs->inv[k][2] * xyz[2];
+		v = (v < 0.0f)? 0.0f : (v > 1.0f)? 1.0f : v;
+		back[k] = (uint16)(powf(v, vs->degamma) * (B_LEN - 1) + 0.5f);
+		err = (back[k] > in[k])? back[k] - in[k] : in[k] - back[k];
+		vs->sum[k] += err;
+		if (err > vs->max[k])
+			vs->max[k] = err;
+		if (err > worst)
+			worst = err;
+	}
+	vs->n++;
+	if (worst > vs->worst)
+	{
+		vs->worst 	= worst;
+		vs->wx 		= x;
+		vs->wy 		= y;
+		for (k = 0; k < 3; k++)
 		{
-			/* bring it into 12 bits */
-			r = (*inptr++);
-			g = (*inptr++);
-			b = (*inptr++);
-			
-			/* Put into Linear space */
-			pi.r = powf((float)r/(float)(B_LEN - 1), g_in);
-			pi.g = powf((float)g/(float)(B_LEN - 1), g_in);
-			pi.b = powf((float)b/(float)(B_LEN - 1), g_in);
-			
-			/* Perform transform RGB -> XYZ */
-			do_matrix(&pi, &po, matrix);
-						
-			/* put back to the Digital gamma space */
-			r = (uint16)(powf(po.r, g_out) * (P_LEN - 1));
-			g = (uint16)(powf(po.g, g_out) * (P_LEN - 1));
-			b = (uint16)(powf(po.b, g_out) * (P_LEN - 1));
-			
-			/* pad it out to 16 bits */			
-			*outptr++ = r * 16;
-			*outptr++ = g * 16 ;
-			*outptr++ = b * 16 ;
+			vs->win[k] 	 = in[k];
+			vs->wout[k]  = out[k];
+			vs->wback[k] = back[k];
 		}
-		if (TIFFWriteScanline(out, outline, i, 0) < 0)
-			break;
 	}
-	_TIFFfree(inputline);
-	_TIFFfree(outline);
 }
 
+/****************************************************************************************************/
+static void verify_report(verifystats *vs, region *r, char *path)
+{
+	static const char *names[3] = {"R", "G", "B"};
+	uint32 k;
+
+	printf("%s: round trip RGB->X'Y'Z'->RGB error in 16 bit codes, %ux%u region at %u,%u:\n", path, r->w, r->h, r->x, r->y);
+	printf("       max       mean\n");
+	for (k = 0; k < 3; k++)
+		printf("%s  %6u  %9.3f\n", names[k], vs->max[k], vs->n? vs->sum[k] / vs->n : 0.0);
+	printf("Worst pixel at %u,%u: RGB %u %u %u -> X'Y'Z' %u %u %u -> RGB %u %u %u\n", vs->wx, vs->wy,
+		   vs->win[0], vs->win[1], vs->win[2], vs->wout[0], vs->wout[1], vs->wout[2],
+		   vs->wback[0], vs->wback[1], vs->wback[2]);
+	free(vs->decode);
+}
 
 /****************************************************************************************************/
 char* usage_txt[] = {
-"usage: toXYZ [options] input.tif output.tif",
+"usage: toXYZ [options] input.tif [output.tif]",
 "where options are:",
 " -r #		make each strip have no more than # rows",
 " -g gamma	use the value 'gamma' for input data (default 2.6)",		
 " -S 		use StEM specified Matrix",
 " -1 		use an identity matrix (1:1)",
 " -p		use power function to calculate gamma (very expensive!)",
+" -l n		make the output LUT n times finer than 16 bits (1-256, default 8)",
+" -i n		interpolate an output LUT of n entries (1-65536, e.g. 4096 fits in L2)",
+" -crop x,y,w,h	only process the w x h region at x,y (also -c x,y,w,h)",
+" -M manifest	incremental mode: skip the image if the manifest (a directory) shows",
+"		the same input content was already converted with the same parameters",
+" -8		write a BigTIFF (done anyway when the output is over 4GB)",
+" --verify	take the output back to RGB in the same pass and print the",
+"		round trip error (max/mean per channel, worst pixel)",
+" -o matrix,gamma,output",
+"		also write output, made with matrix (smpte, stem or ident)",
+"		and input gamma, from the same read of the input (up to 7 times)",
 " -v		print version and exit",
 " ",
 "The DC28.30 matrix (2006-02-24) is used by default.",